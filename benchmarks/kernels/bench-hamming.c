@@ -0,0 +1,93 @@
+// Throughput of each hamming distance kernel in sqlite-vec.c, in vectors
+// scanned per second. Compiles sqlite-vec.c directly so the individual
+// kernels can be called, not just the one selected at load time.
+//
+//   make bench-hamming && ./bench-hamming [dimensions] [vectors]
+#include "../../sqlite-vec.c"
+
+#include <stdio.h>
+#include <time.h>
+
+typedef f32 (*hamming_fn)(const void *a, const void *b, const void *d);
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(const char *name, hamming_fn fn, const u8 *base,
+                  const u8 *query, size_t dimensions, size_t n,
+                  const f32 *expected) {
+  size_t stride = dimensions / CHAR_BIT;
+  for (size_t i = 0; i < n; i++) {
+    if (fn(base + i * stride, query, &dimensions) != expected[i]) {
+      printf("%-10s MISMATCH at vector %zu\n", name, i);
+      return;
+    }
+  }
+  int rounds = 0;
+  double sink = 0;
+  double start = now();
+  double elapsed;
+  do {
+    for (size_t i = 0; i < n; i++) {
+      sink += fn(base + i * stride, query, &dimensions);
+    }
+    rounds++;
+    elapsed = now() - start;
+  } while (elapsed < 1.0);
+  printf("%-10s %8.2f M vectors/s  %6.2f GB/s  (%.0f)\n", name,
+         (double)rounds * n / elapsed / 1e6,
+         (double)rounds * n * stride / elapsed / 1e9, sink / rounds);
+}
+
+int main(int argc, char **argv) {
+  size_t dimensions = argc > 1 ? (size_t)atoll(argv[1]) : 1024;
+  size_t n = argc > 2 ? (size_t)atoll(argv[2]) : 1000000;
+  if (dimensions == 0 || dimensions % CHAR_BIT != 0) {
+    fprintf(stderr, "dimensions must be a positive multiple of 8\n");
+    return 1;
+  }
+  size_t stride = dimensions / CHAR_BIT;
+  u8 *base = malloc(n * stride);
+  u8 *query = malloc(stride);
+  f32 *expected = malloc(n * sizeof(f32));
+  if (!base || !query || !expected) {
+    return 1;
+  }
+  srand(42);
+  for (size_t i = 0; i < n * stride; i++) {
+    base[i] = rand() & 0xff;
+  }
+  for (size_t i = 0; i < stride; i++) {
+    query[i] = rand() & 0xff;
+  }
+  for (size_t i = 0; i < n; i++) {
+    expected[i] =
+        distance_hamming_u8(base + i * stride, query, stride);
+  }
+
+  printf("bit[%zu], %zu vectors\n", dimensions, n);
+  bench("default", distance_hamming_default, base, query, dimensions, n,
+        expected);
+#ifdef SQLITE_VEC_ENABLE_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("popcnt")) {
+    bench("popcnt", hamming_popcnt, base, query, dimensions, n, expected);
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    bench("avx2", hamming_avx2, base, query, dimensions, n, expected);
+  }
+#ifdef SQLITE_VEC_ENABLE_AVX512
+  if (__builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512vpopcntdq")) {
+    bench("avx512", hamming_avx512, base, query, dimensions, n, expected);
+  }
+#endif
+#endif
+  free(base);
+  free(query);
+  free(expected);
+  return 0;
+}
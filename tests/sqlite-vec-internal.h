@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdint.h>
 
 int min_idx(
   // list of distances, size n
@@ -10,3 +11,16 @@ int min_idx(
   // output number of elements
   int32_t k
 );
+
+uint8_t *bitmap_new(int32_t n);
+void bitmap_set(uint8_t *bitmap, int32_t position, int value);
+int bitmap_get(uint8_t *bitmap, int32_t position);
+int bitmap_is_empty(uint8_t *bitmap, int32_t n);
+int32_t bitmap_count(uint8_t *bitmap, int32_t n);
+void bitmap_and_inplace(uint8_t *base, uint8_t *other, int32_t n);
+void bitmap_or_inplace(uint8_t *base, uint8_t *other, int32_t n);
+void bitmap_andnot_inplace(uint8_t *base, uint8_t *other, int32_t n);
+int32_t bitmap_next(uint8_t *bitmap, int32_t n, int32_t i);
+
+// rows abandoned early by every KNN query so far, see SQLITE_VEC_TEST
+extern long long vec0_test_knn_abandoned;
@@ -49,6 +49,15 @@ def _int8(list):
     return struct.pack("%sb" % len(list), *list)
 
 
+def _f16(list):
+    return struct.pack("%se" % len(list), *list)
+
+
+def _bf16(list):
+    # only exact for values that bfloat16 can represent, no rounding
+    return b"".join(_f32([x])[2:] for x in list)
+
+
 def bitmap(bitstring):
     return bytes([int(bitstring, 2)])
 
@@ -98,12 +107,15 @@ def spread_args(args):
 
 FUNCTIONS = [
     "vec_add",
+    "vec_bf16",
     "vec_bit",
     "vec_debug",
     "vec_distance_cosine",
+    "vec_distance_dot",
     "vec_distance_hamming",
     "vec_distance_l1",
     "vec_distance_l2",
+    "vec_f16",
     "vec_f32",
     "vec_int8",
     "vec_length",
@@ -273,9 +285,12 @@ def test_limits():
     with _raises("vec0 constructor error: chunk_size too large"):
         db.execute("create virtual table v using vec0(a float[4], chunk_size=8200)")
     db.execute("create virtual table v using vec0(a float[1])")
+    db.execute("insert into v(rowid, a) values (1, '[0.1]')")
 
-    with _raises("k value in knn query too large, provided 8193 and the limit is 4096"):
-        db.execute("select * from v where a match '[0.1]' and k = 8193")
+    # k has no upper limit, larger values are streamed
+    assert execute_all(
+        db, "select rowid from v where a match '[0.1]' and k = 1000000"
+    ) == [{"rowid": 1}]
 
 
 def test_funcs():
@@ -393,6 +408,48 @@ def test_vec_int8():
         assert db.execute("select subtype(vec_int8(?))", [b"\x00"]).fetchone()[0] == 225
 
 
+def test_vec_f16():
+    vec_f16 = lambda *args, a="?": db.execute(
+        f"select vec_f16({a})", args
+    ).fetchone()[0]
+    assert vec_f16(b"\x00\x3c") == _f16([1])
+    assert vec_f16("[1, -2, 0.5]") == _f16([1, -2, 0.5])
+    assert vec_f16("[1, -2, 0.5]", a="vec_f32(?)") == _f16([1, -2, 0.5])
+    # rounds to nearest even, overflows to inf, keeps subnormals
+    assert vec_f16("[0.1, 65504, 65520, 1e-7]") == _f16(
+        [0.1, 65504, float("inf"), 1e-7]
+    )
+
+    if SUPPORTS_SUBTYPE:
+        assert db.execute("select subtype(vec_f16(?))", [b"\x00\x00"]).fetchone()[0] == 226
+
+    with _raises("zero-length vectors are not supported."):
+        vec_f16(b"")
+    with _raises("invalid float16 vector BLOB length. Must be divisible by 2, found 3"):
+        vec_f16(b"\x00\x00\x00")
+    with _raises("JSON array parsing error: Input does not start with '['"):
+        vec_f16("1]")
+
+
+def test_vec_bf16():
+    vec_bf16 = lambda *args, a="?": db.execute(
+        f"select vec_bf16({a})", args
+    ).fetchone()[0]
+    assert vec_bf16(b"\x80\x3f") == _bf16([1])
+    assert vec_bf16("[1, -2, 0.5]") == _bf16([1, -2, 0.5])
+    assert vec_bf16("[1, -2, 0.5]", a="vec_f32(?)") == _bf16([1, -2, 0.5])
+    # rounds to nearest even: 1 + 2^-8 is a tie and rounds down to 1
+    assert vec_bf16("[1.00390625, 1.01171875]") == _bf16([1, 1.015625])
+
+    if SUPPORTS_SUBTYPE:
+        assert db.execute("select subtype(vec_bf16(?))", [b"\x00\x00"]).fetchone()[0] == 227
+
+    with _raises("zero-length vectors are not supported."):
+        vec_bf16(b"")
+    with _raises("invalid bfloat16 vector BLOB length. Must be divisible by 2, found 3"):
+        vec_bf16(b"\x00\x00\x00")
+
+
 def npy_cosine(a, b):
     return 1 - (np.dot(a, b) / (np.linalg.norm(a) * np.linalg.norm(b)))
 
@@ -424,6 +481,36 @@ def test_vec_distance_cosine():
     assert vec_distance_cosine("[1.1, 1.0]", "[1.2, 1.2]") == 0.001131898257881403
 
 
+def test_vec_distance_dot():
+    vec_distance_dot = lambda *args, a="?", b="?": db.execute(
+        f"select vec_distance_dot({a}, {b})", args
+    ).fetchone()[0]
+
+    assert vec_distance_dot("[1, 1]", "[2, 2]") == -4
+    assert vec_distance_dot("[1, 1]", "[-2, -2]") == 4
+    assert isclose(
+        vec_distance_dot("[1.1, 2.2, 3.3]", "[4.4, 5.5, 6.6]"), -38.72, rel_tol=1e-6
+    )
+    assert (
+        vec_distance_dot(
+            _int8([1, 2, -3]), _int8([4, -5, 6]), a="vec_int8(?)", b="vec_int8(?)"
+        )
+        == 24
+    )
+
+    with pytest.raises(
+        sqlite3.OperationalError,
+        match="Cannot calculate dot product distance between two bitvectors.",
+    ):
+        db.execute("select vec_distance_dot(vec_bit(X'FF'), vec_bit(X'FF'))")
+
+    with pytest.raises(
+        sqlite3.OperationalError,
+        match="Vector type mistmatch",
+    ):
+        db.execute("select vec_distance_dot('[1, 1]', vec_int8('[2, 2]'))")
+
+
 def test_vec_distance_hamming():
     vec_distance_hamming = lambda *args: db.execute(
         "select vec_distance_hamming(vec_bit(?), vec_bit(?))", args
@@ -432,6 +519,14 @@ def test_vec_distance_hamming():
     assert vec_distance_hamming(b"\xff", b"\x01") == 7
     assert vec_distance_hamming(b"\xab", b"\xab") == 0
 
+    # every byte length up to and past the 512 byte blocks of the SIMD kernels
+    rng = np.random.default_rng(1)
+    for n in list(range(1, 80)) + [511, 512, 513, 1000, 1024]:
+        a = rng.integers(0, 256, n, dtype=np.uint8).tobytes()
+        b = rng.integers(0, 256, n, dtype=np.uint8).tobytes()
+        expected = sum(bin(x ^ y).count("1") for x, y in zip(a, b))
+        assert vec_distance_hamming(a, b) == expected
+
     with pytest.raises(
         sqlite3.OperationalError,
         match="Cannot calculate hamming distance between two float32 vectors.",
@@ -530,6 +625,52 @@ def test_vec_distance_l2():
     check([1, 2, 3], [-9, -8, -7], dtype=np.int8)
 
 
+def test_vec_distance_simd_widths():
+    # SIMD kernels process blocks of 8/16/32 elements plus a remainder, so
+    # check every width around those boundaries against numpy.
+    rng = np.random.default_rng(1)
+
+    def distance(metric, a, b, transform):
+        return db.execute(
+            f"select vec_distance_{metric}({transform}, {transform})", [a, b]
+        ).fetchone()[0]
+
+    for d in [*range(1, 70), 100, 300, 768, 1000, 1536]:
+        a = rng.uniform(-2, 2, d).astype(np.float32)
+        b = rng.uniform(-2, 2, d).astype(np.float32)
+        assert isclose(distance("l2", a, b, "?"), npy_l2(a, b), rel_tol=1e-5)
+        assert isclose(
+            distance("l1", a, b, "?"),
+            np.sum(np.abs(a.astype(np.float64) - b.astype(np.float64))),
+            rel_tol=1e-9,
+        )
+        assert isclose(
+            distance("cosine", a, b, "?"), npy_cosine(a, b), rel_tol=1e-4, abs_tol=1e-6
+        )
+        assert isclose(
+            distance("dot", a, b, "?"),
+            -np.dot(a.astype(np.float64), b.astype(np.float64)),
+            rel_tol=1e-4,
+            abs_tol=1e-4,
+        )
+
+        a = rng.integers(-128, 127, d, endpoint=True).astype(np.int8)
+        b = rng.integers(-128, 127, d, endpoint=True).astype(np.int8)
+        a_wide = a.astype(np.int64)
+        b_wide = b.astype(np.int64)
+        assert isclose(
+            distance("l2", a, b, "vec_int8(?)"), npy_l2(a_wide, b_wide), rel_tol=1e-5
+        )
+        assert distance("l1", a, b, "vec_int8(?)") == np.sum(np.abs(a_wide - b_wide))
+        assert isclose(
+            distance("cosine", a, b, "vec_int8(?)"),
+            npy_cosine(a_wide, b_wide),
+            rel_tol=1e-4,
+            abs_tol=1e-6,
+        )
+        assert distance("dot", a, b, "vec_int8(?)") == -np.dot(a_wide, b_wide)
+
+
 def test_vec_length():
     def test_f32():
         vec_length = lambda *args: db.execute("select vec_length(?)", args).fetchone()[
@@ -656,6 +797,8 @@ def test_vec_type():
     assert vec_type("[1]", a="vec_f32(?)") == "float32"
     assert vec_type("[1]", a="vec_int8(?)") == "int8"
     assert vec_type(b"\xaa", a="vec_bit(?)") == "bit"
+    assert vec_type("[1]", a="vec_f16(?)") == "float16"
+    assert vec_type("[1]", a="vec_bf16(?)") == "bfloat16"
 
     with _raises("invalid float32 vector"):
         vec_type(b"\xaa")
@@ -729,6 +872,8 @@ def test_vec_to_json():
     assert vec_to_json(b"\x04\xff", input="vec_int8(?)") == "[4,-1]"
     assert vec_to_json(b"\xff", input="vec_bit(?)") == "[1,1,1,1,1,1,1,1]"
     assert vec_to_json(b"\x0f", input="vec_bit(?)") == "[1,1,1,1,0,0,0,0]"
+    assert vec_to_json("[1.5, -2, 0.1]", input="vec_f16(?)") == "[1.500000,-2.000000,0.099976]"
+    assert vec_to_json("[1.5, -2, 3.14159]", input="vec_bf16(?)") == "[1.500000,-2.000000,3.140625]"
 
 
 @pytest.mark.skip(reason="TODO")
@@ -1559,7 +1704,9 @@ def test_vec0_best_index():
         ):
             db.execute("select * from t where rowid in(4,5,6) and rowid in (1, 2,3)")
 
-    with _raises("A LIMIT or 'k = ?' constraint is required on vec0 knn queries."):
+    with _raises(
+        "A LIMIT, 'k = ?' or 'distance < ?' constraint is required on vec0 knn queries."
+    ):
         db.execute("select * from t where aaa MATCH ?")
 
     if SUPPORTS_VTAB_LIMIT:
@@ -2080,7 +2227,7 @@ def test_vec0_knn():
         db, "select rowid from v where aaa match vec_f32(?) and k = 9", [qaaa]
     ) == [
         {"rowid": 1},
-        {"rowid": 2},  # ordering of 2 and 0 here depends on if min_idx uses < or <=
+        {"rowid": 2},  # ties are ordered by descending chunk offset, see topk_before()
         {"rowid": 0},  #
         {"rowid": 3},
         {"rowid": 4},
@@ -2431,6 +2578,12 @@ def test_vec0_distance_metric():
     db.execute("create virtual table v4 using vec0( a float[2] distance_metric=cosine)")
     db.execute(f"insert into v4(a) values {base}")
 
+    db.execute("create virtual table v5 using vec0( a float[2] distance_metric=dot)")
+    db.execute(f"insert into v5(a) values {base}")
+
+    db.execute("create virtual table v6 using vec0( a int8[2] distance_metric=dot)")
+    db.execute(f"insert into v6(a) select vec_int8(value) from json_each('[[1, 2], [3, 4], [5, 6]]')")
+
     # default (L2)
     assert execute_all(
         db, "select rowid, distance from v1 where a match ? and k = 3", [q]
@@ -2464,6 +2617,1525 @@ def test_vec0_distance_metric():
         {"rowid": 2, "distance": 1.9838699102401733},
         {"rowid": 1, "distance": 2},
     ]
+    # dot
+    assert execute_all(
+        db, "select rowid, distance from v5 where a match ? and k = 3", [q]
+    ) == [
+        {"rowid": 1, "distance": 5},
+        {"rowid": 2, "distance": 11},
+        {"rowid": 3, "distance": 17},
+    ]
+    assert execute_all(
+        db,
+        "select rowid, distance from v6 where a match vec_int8(?) and k = 3",
+        [q],
+    ) == [
+        {"rowid": 1, "distance": 5},
+        {"rowid": 2, "distance": 11},
+        {"rowid": 3, "distance": 17},
+    ]
+
+
+def test_vec0_distance_metric_cosine_norms(tmp_path):
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(a float[8] distance_metric=cosine, b int8[8] distance_metric=cosine, c float[8], chunk_size=8)"
+    )
+    # only cosine columns store per-row norms
+    assert [
+        row["name"]
+        for row in execute_all(
+            db, "select name from sqlite_master where name like 'v_vector%' order by 1"
+        )
+    ] == [
+        "v_vector_chunks00",
+        "v_vector_chunks01",
+        "v_vector_chunks02",
+        "v_vector_norms00",
+        "v_vector_norms01",
+    ]
+
+    rng = np.random.default_rng(2)
+    a = rng.uniform(-1, 1, (20, 8)).astype(np.float32)
+    b = rng.integers(-128, 128, (20, 8), dtype=np.int8)
+    for i in range(20):
+        db.execute(
+            "insert into v(rowid, a, b, c) values (?, ?, vec_int8(?), ?)",
+            [i + 1, a[i], b[i], a[i]],
+        )
+    a[3] = rng.uniform(-1, 1, 8)
+    db.execute("update v set a = ? where rowid = 4", [a[3]])
+    db.execute("delete from v where rowid = 5")
+
+    def check(q, column, transform="?"):
+        knn = execute_all(
+            db,
+            f"select rowid, distance from v where {column} match {transform} and k = 19",
+            [q],
+        )
+        brute = execute_all(
+            db,
+            f"select rowid, vec_distance_cosine({column}, {transform}) as distance from v order by 2 limit 19",
+            [q],
+        )
+        assert [row["rowid"] for row in knn] == [row["rowid"] for row in brute]
+        for x, y in zip(knn, brute):
+            assert isclose(x["distance"], y["distance"], abs_tol=1e-6)
+
+    check(a[0], "a")
+    check(a[3], "a")
+    check(b[0], "b", "vec_int8(?)")
+
+    # tables from before stored norms existed don't have the shadow table
+    path = str(tmp_path / "old.db")
+    db = connect(EXT_PATH, path)
+    db.execute("create virtual table v using vec0(a float[2] distance_metric=cosine)")
+    db.execute("insert into v(rowid, a) values (1, '[1, 2]'), (2, '[3, 4]')")
+    db.execute("drop table v_vector_norms00")
+    db.commit()
+    db.close()
+    db = connect(EXT_PATH, path)
+    db.execute("insert into v(rowid, a) values (3, '[5, 6]')")
+    assert execute_all(
+        db, "select rowid, distance from v where a match '[-1, -2]' and k = 3"
+    ) == [
+        {"rowid": 3, "distance": 1.9734171628952026},
+        {"rowid": 2, "distance": 1.9838699102401733},
+        {"rowid": 1, "distance": 2},
+    ]
+    db.close()
+
+
+def test_vec0_knn_chunk_kernels():
+    # KNN computes a whole chunk at once, blocking several rows per kernel
+    # call. Distances must still match the scalar functions exactly,
+    # including rows left over after blocking and deleted rows in between.
+    db = connect(EXT_PATH)
+    rng = np.random.default_rng(3)
+    for d in [1, 7, 8, 15, 16, 17, 33, 100]:
+        for metric in ["l2", "dot"]:
+            db.execute("drop table if exists v")
+            db.execute(
+                f"create virtual table v using vec0(a float[{d}] distance_metric={metric}, chunk_size=16)"
+            )
+            vectors = rng.uniform(-1, 1, (37, d)).astype(np.float32)
+            for i, v in enumerate(vectors):
+                db.execute("insert into v(rowid, a) values (?, ?)", [i + 1, v])
+            db.execute("delete from v where rowid in (2, 5, 6, 20)")
+            q = rng.uniform(-1, 1, d).astype(np.float32)
+            knn = execute_all(
+                db, "select rowid, distance from v where a match ? and k = 40", [q]
+            )
+            expected = execute_all(
+                db,
+                f"select rowid, vec_distance_{metric}(a, ?) as distance from v order by 2, 1",
+                [q],
+            )
+            assert sorted(knn, key=lambda r: r["rowid"]) == sorted(
+                expected, key=lambda r: r["rowid"]
+            )
+
+
+def test_vec0_knn_large_k():
+    # k larger than a chunk, spread over several partially filled chunks
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    values = [(i * 37) % 101 + 0.25 for i in range(1, 60)]
+    for i, value in enumerate(values):
+        db.execute("insert into v(rowid, a) values (?, ?)", [i + 1, _f32([value])])
+    db.execute("delete from v where rowid in (3, 9, 10, 31)")
+    expected = sorted(
+        (abs(value - 50.0), i + 1)
+        for i, value in enumerate(values)
+        if i + 1 not in (3, 9, 10, 31)
+    )
+    for k in [1, 7, 8, 9, 30, 55, 100]:
+        assert execute_all(
+            db, "select rowid, distance from v where a match '[50]' and k = ?", [k]
+        ) == [{"rowid": rowid, "distance": d} for d, rowid in expected[:k]]
+
+
+def test_vec0_knn_nan_distances():
+    # cosine distances to zero vectors are NaN, which rank after every
+    # number instead of pushing the true neighbors out of the top k
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[16] distance_metric=cosine)")
+    rng = np.random.default_rng(7)
+    vectors = rng.uniform(-1, 1, (1000, 16)).astype(np.float32)
+    vectors[rng.choice(1000, 100, replace=False)] = 0
+    for i, vector in enumerate(vectors):
+        db.execute("insert into v(rowid, a) values (?, ?)", [i + 1, vector])
+    norms = np.linalg.norm(vectors, axis=1)
+    for query in rng.uniform(-1, 1, (10, 16)).astype(np.float32):
+        distances = 1 - vectors @ query / (np.maximum(norms, 1) * np.linalg.norm(query))
+        ranked = (np.argsort(np.where(norms == 0, np.inf, distances)) + 1).tolist()
+        knn = "select rowid, distance from v where a match ? and k = ?"
+        rows = db.execute(knn, [query, 10]).fetchall()
+        assert [row[0] for row in rows] == ranked[:10]
+        # with every other row returned, the zero vectors come last
+        rows = db.execute(knn, [query, 1000]).fetchall()
+        assert [row[0] for row in rows[:900]] == ranked[:900]
+        assert [row[1] for row in rows[900:]] == [None] * 100
+
+
+def test_vec0_knn_nan_distances_across_chunks():
+    # NaN distances of zero vectors in later chunks must not be merged ahead
+    # of, or in between, the rows found in earlier chunks
+    db = connect(EXT_PATH)
+    zero = {5, 9, 10, 11, 15, 20, 25, 30, 35, 40}
+    for name, options in [("single", ""), ("threaded", ", threads=2")]:
+        db.execute(
+            f"create virtual table {name} using vec0(a float[2] distance_metric=cosine, chunk_size=8{options})"
+        )
+        for i in range(1, 41):
+            angle = (i * 7) % 40 * 0.07
+            vector = [0, 0] if i in zero else [np.cos(angle), np.sin(angle)]
+            db.execute(
+                f"insert into {name}(rowid, a) values (?, ?)", [i, _f32(vector)]
+            )
+    # cosine distances grow with the angle to [1, 0]
+    expected = sorted(
+        (i for i in range(1, 41) if i not in zero), key=lambda i: (i * 7) % 40
+    )
+    for name in ["single", "threaded"]:
+        for k in [1, 3, 8, 20, 30]:
+            rows = execute_all(
+                db,
+                f"select rowid, distance from {name} where a match '[1, 0]' and k = ?",
+                [k],
+            )
+            assert [row["rowid"] for row in rows] == expected[:k]
+        rows = execute_all(
+            db, f"select rowid, distance from {name} where a match '[1, 0]' and k = 40"
+        )
+        assert [row["rowid"] for row in rows[:30]] == expected
+        assert {row["rowid"] for row in rows[30:]} == zero
+        assert [row["distance"] for row in rows[30:]] == [None] * 10
+
+
+def test_vec0_knn_filtered_chunks():
+    # blobs are reused across chunks, and chunks left without any rows by
+    # deletes or filters are skipped without reading their vectors
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(a float[1], n integer, t text, chunk_size=8)"
+    )
+    long_text = "x" * 40
+    for i in range(1, 41):
+        db.execute(
+            "insert into v(rowid, a, n, t) values (?, ?, ?, ?)",
+            [i, _f32([i]), i // 8, long_text if i % 3 else "short"],
+        )
+    db.execute("delete from v where rowid between 8 and 15")
+    assert execute_all(
+        db,
+        "select rowid from v where a match '[0]' and k = 4 and n != 2 and t = ?",
+        [long_text],
+    ) == [{"rowid": 1}, {"rowid": 2}, {"rowid": 4}, {"rowid": 5}]
+    assert execute_all(
+        db,
+        "select rowid from v where a match '[0]' and k = 3 and n = 3 and t = 'short'",
+    ) == [{"rowid": 24}, {"rowid": 27}, {"rowid": 30}]
+    assert execute_all(
+        db,
+        "select rowid from v where a match '[0]' and k = 3 and rowid in (9, 33, 40)",
+    ) == [{"rowid": 33}, {"rowid": 40}]
+
+
+def test_vec0_knn_early_abandon():
+    # after the first chunk, L2 and L1 rows are abandoned part way through
+    # once they pass the k-th best distance, which must not change results
+    db = connect(EXT_PATH)
+    rng = np.random.default_rng(11)
+    d = 300
+    centers = rng.uniform(-1, 1, (4, d)).astype(np.float32)
+    for metric in ["l2", "l1"]:
+        db.execute("drop table if exists v")
+        db.execute(
+            f"create virtual table v using vec0(a float[{d}] distance_metric={metric}, chunk_size=8)"
+        )
+        for i in range(64):
+            v = centers[i % 4] + rng.uniform(-0.1, 0.1, d).astype(np.float32)
+            db.execute("insert into v(rowid, a) values (?, ?)", [i + 1, v])
+        q = centers[1] + rng.uniform(-0.1, 0.1, d).astype(np.float32)
+        for k in [1, 3, 20]:
+            knn = execute_all(
+                db, "select rowid, distance from v where a match ? and k = ?", [q, k]
+            )
+            expected = execute_all(
+                db,
+                f"select rowid, vec_distance_{metric}(a, ?) as distance from v order by 2 limit ?",
+                [q, k],
+            )
+            assert [r["rowid"] for r in knn] == [r["rowid"] for r in expected]
+            assert [r["distance"] for r in knn] == pytest.approx(
+                [r["distance"] for r in expected]
+            )
+
+
+def test_vec0_knn_fixed_width_kernels():
+    # common embedding widths get their own kernels, which must agree with
+    # the generic ones exactly
+    db = connect(EXT_PATH)
+    rng = np.random.default_rng(9)
+    for d in [128, 256, 384, 512, 768, 1024, 1536, 3072]:
+        for metric in ["l2", "dot"]:
+            db.execute("drop table if exists v")
+            db.execute(
+                f"create virtual table v using vec0(a float[{d}] distance_metric={metric}, chunk_size=8)"
+            )
+            vectors = rng.uniform(-1, 1, (11, d)).astype(np.float32)
+            for i, v in enumerate(vectors):
+                db.execute("insert into v(rowid, a) values (?, ?)", [i + 1, v])
+            q = rng.uniform(-1, 1, d).astype(np.float32)
+            knn = execute_all(
+                db, "select rowid, distance from v where a match ? and k = 11", [q]
+            )
+            expected = execute_all(
+                db,
+                f"select rowid, vec_distance_{metric}(a, ?) as distance from v order by 2, 1",
+                [q],
+            )
+            assert sorted(knn, key=lambda r: r["rowid"]) == sorted(
+                expected, key=lambda r: r["rowid"]
+            )
+
+
+def test_vec0_knn_chunk_cache(tmp_path):
+    with _raises(
+        "vec0 constructor error: could not parse table option 'chunk_cache_size=-1'"
+    ):
+        connect(EXT_PATH).execute(
+            "create virtual table v using vec0(a float[1], chunk_cache_size=-1)"
+        )
+    for value in ["abc", "65537", "2000000000", "99999999999"]:
+        with _raises(
+            "vec0 constructor error: chunk_cache_size must be between 0 and 65536"
+        ):
+            connect(EXT_PATH).execute(
+                f"create virtual table v using vec0(a float[1], chunk_cache_size={value})"
+            )
+
+    # a large cache only allocates buckets for the chunks it holds, and grows
+    # them as more chunks are cached
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(a float[1], chunk_size=8, chunk_cache_size=65536)"
+    )
+    db.execute("insert into v(rowid, a) values (1, '[1]')")
+    assert execute_all(db, "select rowid from v where a match '[0]' and k = 1") == [
+        {"rowid": 1}
+    ]
+    for i in range(2, 401):
+        db.execute("insert into v(rowid, a) values (?, ?)", [i, _f32([i])])
+    for _ in range(2):
+        assert [
+            row[0]
+            for row in db.execute(
+                "select rowid from v where a match '[0]' and k = 400"
+            ).fetchall()
+        ] == list(range(1, 401))
+
+    # the cache holds fewer chunks than the table has, so entries get evicted
+    path = str(tmp_path / "cache.db")
+    db = connect(EXT_PATH, path)
+    db.execute(
+        "create virtual table v using vec0(a float[1], b float[2] distance_metric=cosine, chunk_size=8, chunk_cache_size=3)"
+    )
+    for i in range(1, 41):
+        db.execute(
+            "insert into v(rowid, a, b) values (?, ?, ?)",
+            [i, _f32([i]), _f32([1, i])],
+        )
+    db.commit()
+
+    def knn(conn, k=4):
+        return [
+            row["rowid"]
+            for row in execute_all(
+                conn, "select rowid from v where a match '[0]' and k = ?", [k]
+            )
+        ]
+
+    for _ in range(3):
+        assert knn(db) == [1, 2, 3, 4]
+        assert knn(db, 40) == list(range(1, 41))
+        assert [
+            row["rowid"]
+            for row in execute_all(
+                db, "select rowid from v where b match '[1, 20]' and k = 3"
+            )
+        ] == [20, 21, 19]
+
+    # writes from this connection, committed or not
+    db.execute("delete from v where rowid = 2")
+    assert knn(db) == [1, 3, 4, 5]
+    db.execute("update v set a = '[0.25]' where rowid = 30")
+    assert knn(db) == [30, 1, 3, 4]
+    db.commit()
+    db.execute("insert into v(rowid, a, b) values (41, '[0.5]', '[1, 1]')")
+    assert knn(db) == [30, 41, 1, 3]
+    db.rollback()
+    assert knn(db) == [30, 1, 3, 4]
+
+    # writes from another connection
+    db2 = connect(EXT_PATH, path)
+    assert knn(db2) == [30, 1, 3, 4]
+    db2.execute("update v set a = '[0]' where rowid = 40")
+    db2.commit()
+    assert knn(db) == [40, 30, 1, 3]
+
+
+def test_vec0_knn_sparse_chunks():
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(a float[2], b float[2] distance_metric=cosine, chunk_size=64)"
+    )
+    for i in range(1, 257):
+        db.execute(
+            "insert into v(rowid, a, b) values (?, ?, ?)",
+            [i, _f32([i, -i]), _f32([1, i / 32])],
+        )
+    # empty the 2nd chunk and leave a few rows, some of them next to each
+    # other, in the 3rd one
+    kept = [130, 131, 132, 150, 191]
+    db.execute(
+        "delete from v where (rowid between 65 and 128) or (rowid between 129 and 192 and rowid not in (130, 131, 132, 150, 191))"
+    )
+    remaining = list(range(1, 65)) + kept + list(range(193, 257))
+
+    def knn(column, query, k):
+        return [
+            row["rowid"]
+            for row in execute_all(
+                db,
+                f"select rowid from v where {column} match ? and k = ?",
+                [query, k],
+            )
+        ]
+
+    assert knn("a", "[145, -145]", 6) == [150, 132, 131, 130, 191, 193]
+    assert knn("a", "[0, 0]", 300) == remaining
+    assert knn("b", "[32, 150]", 3) == [150, 132, 131]
+    assert execute_all(
+        db, "select count(*) as n from v_chunks where validity != zeroblob(8)"
+    ) == [{"n": 3}]
+
+
+def test_vec0_knn_distance_constraints():
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[1], chunk_size=8)")
+    db.executemany(
+        "insert into v(rowid, a) values (?, ?)",
+        [(i, _f32([i / 10])) for i in range(1, 41)],
+    )
+
+    def knn(sql, *params):
+        return [row["rowid"] for row in execute_all(db, sql, ["[0]", *params])]
+
+    # the threshold is pushed into the scan
+    assert "<" in execute_all(
+        db,
+        "explain query plan select rowid from v where a match ? and distance < 0.5",
+        ["[0]"],
+    )[0]["detail"]
+
+    # radius queries without a k or LIMIT return every row within distance
+    assert knn("select rowid from v where a match ? and distance < ?", 0.45) == [
+        1,
+        2,
+        3,
+        4,
+    ]
+    # row 3 is exactly 0.3 as a float32 away
+    f32_03 = struct.unpack("f", _f32([0.3]))[0]
+    assert knn("select rowid from v where a match ? and distance <= ?", f32_03) == [
+        1,
+        2,
+        3,
+    ]
+    assert knn("select rowid from v where a match ? and distance < ?", f32_03) == [
+        1,
+        2,
+    ]
+    assert knn("select rowid from v where a match ? and distance < ?", 0.3) == [
+        1,
+        2,
+    ]
+    assert knn("select rowid from v where a match ? and distance < ?", 100) == list(
+        range(1, 41)
+    )
+    assert knn("select rowid from v where a match ? and distance < ?", -1) == []
+
+    # with k or LIMIT, the k nearest rows within the distance
+    assert knn(
+        "select rowid from v where a match ? and k = 3 and distance < ?", 0.45
+    ) == [1, 2, 3]
+    assert knn(
+        "select rowid from v where a match ? and k = 10 and distance < ?", 0.45
+    ) == [1, 2, 3, 4]
+    assert knn(
+        "select rowid from v where a match ? and distance < 0.2 and distance <= ?",
+        0.55,
+    ) == [1]
+    if SUPPORTS_VTAB_LIMIT:
+        assert knn(
+            "select rowid from v where a match ? and distance < ? limit 2 offset 1",
+            0.45,
+        ) == [2, 3]
+
+    # constraints that aren't numbers are checked by SQLite as usual
+    assert knn("select rowid from v where a match ? and distance < ?", None) == []
+    assert knn("select rowid from v where a match ? and distance < ?", "x") == list(
+        range(1, 41)
+    )
+
+
+def test_vec0_knn_threads():
+    with _raises("vec0 constructor error: threads must be between 1 and 64"):
+        connect(EXT_PATH).execute(
+            "create virtual table v using vec0(a float[1], threads=0)"
+        )
+    with _raises("vec0 constructor error: threads must be between 1 and 64"):
+        connect(EXT_PATH).execute(
+            "create virtual table v using vec0(a float[1], threads=65)"
+        )
+
+    # builds without SQLITE_VEC_ENABLE_THREADS scan on a single thread, either
+    # way the results match a single-threaded table
+    db = connect(EXT_PATH)
+    for name, options in [
+        ("single", ""),
+        ("threaded", ", threads=3"),
+        ("cached", ", threads=4, chunk_cache_size=2"),
+    ]:
+        db.execute(
+            f"create virtual table {name} using vec0(a float[2], n integer, chunk_size=8{options})"
+        )
+        for i in range(1, 101):
+            db.execute(
+                f"insert into {name}(rowid, a, n) values (?, ?, ?)",
+                [i, _f32([i % 17, i % 5]), i % 3],
+            )
+        db.execute(f"delete from {name} where rowid % 7 = 0")
+
+    for k in [1, 5, 8, 40, 100]:
+        for where in ["", "and n = 1", "and rowid in (3, 50, 51, 99)"]:
+            results = [
+                execute_all(
+                    db,
+                    f"select rowid, distance from {name} where a match '[3, 2]' and k = ? {where}",
+                    [k],
+                )
+                for name in ["single", "threaded", "cached"]
+            ]
+            assert results[0] == results[1] == results[2]
+
+    # the workers are kept between queries, and see rows written since
+    for name in ["single", "threaded"]:
+        db.execute(f"update {name} set a = '[3, 2]' where rowid = 90")
+    assert execute_all(
+        db, "select rowid from threaded where a match '[3, 2]' and k = 3"
+    ) == execute_all(db, "select rowid from single where a match '[3, 2]' and k = 3")
+    # and shut down with the table
+    db.execute("drop table threaded")
+    db.close()
+
+
+def test_vec0_knn_streamed():
+    # k above 4096 is answered in several passes, each returning the rows
+    # after the previous ones. Lots of equal distances cross pass boundaries.
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(a float[1], n integer, chunk_size=64)"
+    )
+    n = 9000
+    db.executemany(
+        "insert into v(rowid, a, n) values (?, ?, ?)",
+        [(i, _f32([(i * 7919) % 3001 * 0.5]), i % 3) for i in range(1, n + 1)],
+    )
+    db.execute("delete from v where rowid % 10 = 0")
+
+    def check(k, where="", limit=None, offset=None):
+        if limit is None:
+            sql = f"select rowid, distance from v where a match '[700]' and k = {k} {where}"
+        else:
+            sql = f"select rowid, distance from v where a match '[700]' {where} limit {limit} offset {offset}"
+        knn = execute_all(db, sql)
+        brute = execute_all(
+            db,
+            f"select rowid, abs(vec_to_json(a) ->> '$[0]' - 700) as distance from v where 1 {where} order by 2",
+        )
+        start = offset or 0
+        expected = brute[start : start + (limit or k)]
+        assert [row["distance"] for row in knn] == [
+            row["distance"] for row in expected
+        ]
+        # every row at most once, and the same rows up to ties at the last
+        # distance
+        assert len({row["rowid"] for row in knn}) == len(knn)
+        if knn:
+            last = knn[-1]["distance"]
+            assert {row["rowid"] for row in knn if row["distance"] < last} == {
+                row["rowid"] for row in expected if row["distance"] < last
+            }
+
+    for k in [4096, 4097, 5000, 8100, 8101, 20000]:
+        check(k)
+    check(6000, "and n = 1")
+    check(6000, "and rowid in (1, 2, 3, 5000, 8999)")
+    if SUPPORTS_VTAB_LIMIT:
+        check(None, limit=10, offset=5000)
+        check(None, limit=5000, offset=2)
+
+
+def test_vec0_cluster_chunks():
+    for options in ["cluster_chunks=0", "cluster_chunks=65"]:
+        with _raises("vec0 constructor error: cluster_chunks must be between 1 and 64"):
+            connect(EXT_PATH).execute(
+                f"create virtual table v using vec0(a float[2], {options})"
+            )
+    for column in ["a float[2] distance_metric=cosine", "a int8[2]", "a bit[8]"]:
+        with _raises(
+            "vec0 constructor error: cluster_chunks requires a float32 vector column with the L2 or L1 distance metric"
+        ):
+            connect(EXT_PATH).execute(
+                f"create virtual table v using vec0({column}, cluster_chunks=4)"
+            )
+
+    db = connect(EXT_PATH)
+    for name, options in [
+        ("v", "a float[4], b float[2] distance_metric=cosine, chunk_size=8, cluster_chunks=8"),
+        ("v_l1", "a float[4] distance_metric=l1, b float[2], chunk_size=8, cluster_chunks=8"),
+        ("appended", "a float[4], b float[2], chunk_size=8, cluster_chunks=1"),
+        ("brute", "a float[4], b float[2], chunk_size=8"),
+        ("brute_l1", "a float[4] distance_metric=l1, b float[2], chunk_size=8"),
+    ]:
+        db.execute(
+            f"create virtual table {name} using vec0(p text partition key, n integer, {options})"
+        )
+    # only vector columns that support bounds have them
+    assert execute_all(
+        db, "select name from sqlite_master where name like 'v_chunk_bounds%'"
+    ) == [{"name": "v_chunk_bounds00"}]
+    assert execute_all(
+        db, "select name from sqlite_master where name like 'v_l1_chunk_bounds%'"
+    ) == [{"name": "v_l1_chunk_bounds00"}, {"name": "v_l1_chunk_bounds01"}]
+
+    # rows of 8 clusters, inserted in mixed order
+    centers = [list(np.random.default_rng(c).uniform(-50, 50, 4)) for c in range(8)]
+    vectors = {}
+    for i in range(1, 401):
+        noise = np.random.default_rng(i).uniform(-2, 2, 4)
+        vectors[i] = [x + y for x, y in zip(centers[(i * 5) % 8], noise)]
+        for name in ["v", "v_l1", "appended", "brute", "brute_l1"]:
+            db.execute(
+                f"insert into {name}(rowid, p, n, a, b) values (?, ?, ?, ?, ?)",
+                [i, "ab"[i % 2], i % 5, _f32(vectors[i]), _f32([1, i])],
+            )
+
+    knn = "select rowid, distance from {} where a match ? {}"
+
+    def check(query, where="and k = 10"):
+        for name, brute in [("v", "brute"), ("v_l1", "brute_l1"), ("appended", "brute")]:
+            assert execute_all(db, knn.format(name, where), [_f32(query)]) == execute_all(
+                db, knn.format(brute, where), [_f32(query)]
+            )
+
+    def check_all():
+        for query in centers[:3] + [vectors[7], [0, 0, 0, 0]]:
+            for where in [
+                "and k = 1",
+                "and k = 10",
+                "and k = 100",
+                "and k = 10 and p = 'a'",
+                "and k = 10 and n = 3",
+                "and k = 10 and n in (1, 2)",
+                "and k = 10 and rowid in (1, 2, 3, 100, 200, 300)",
+                "and distance < 5",
+            ]:
+                check(query, where)
+
+    check_all()
+
+    # chunks hold nearby rows, and each has its centroid and radius
+    def bounds(name):
+        return [
+            struct.unpack("4ffI", row[0])
+            for row in db.execute(f"select bounds from {name}_chunk_bounds00")
+        ]
+
+    assert len(bounds("v")) == db.execute("select count(*) from v_chunks").fetchone()[0]
+    radii = lambda name: [b[4] for b in bounds(name)]
+    assert sum(radii("v")) / len(radii("v")) < sum(radii("appended")) / len(radii("appended")) / 4
+
+    # the vectors of chunks that can't have any of the results aren't read.
+    # Rewriting them to the query vector doesn't change the results.
+    query = centers[0]
+    tenth = execute_all(db, knn.format("brute", "and k = 10"), [_f32(query)])[-1]
+    for rowid, blob in db.execute("select rowid, bounds from v_chunk_bounds00").fetchall():
+        *centroid, radius, count = struct.unpack("4ffI", blob)
+        distance = sum((x - y) ** 2 for x, y in zip(centroid, query)) ** 0.5
+        if distance - radius > tenth["distance"] * 1.01:
+            db.execute(
+                "update v_vector_chunks00 set vectors = ? where rowid = ?",
+                [_f32(query * 8), rowid],
+            )
+    assert execute_all(db, knn.format("v", "and k = 10"), [_f32(query)]) == execute_all(
+        db, knn.format("brute", "and k = 10"), [_f32(query)]
+    )
+    for rowid in range(1, 401):
+        db.execute("update v set a = ? where rowid = ?", [_f32(vectors[rowid]), rowid])
+
+    # deleted rows leave the bounds as they are, updated rows grow them
+    for name in ["v", "v_l1", "appended", "brute", "brute_l1"]:
+        db.execute(f"delete from {name} where rowid % 3 = 0")
+        for i in [1, 2, 4]:
+            db.execute(f"update {name} set a = ? where rowid = ?", [_f32([200, i, 0, 0]), i])
+        for i in range(401, 421):
+            db.execute(
+                f"insert into {name}(rowid, p, n, a, b) values (?, ?, ?, ?, ?)",
+                [i, "ab"[i % 2], i % 5, _f32([-200, i, 0, 0]), _f32([1, i])],
+            )
+    check_all()
+    check([200, 1, 0, 0])
+    check([-200, 410.3, 0, 0])
+
+    # bounds are recomputed after ivf-train moves rows between chunks
+    db.execute(
+        "create virtual table ivf using vec0(a float[4] index=ivf(nlist=4, nprobe=4), chunk_size=8, cluster_chunks=4)"
+    )
+    db.execute("create virtual table brute_ivf using vec0(a float[4], chunk_size=8)")
+    for i in range(1, 301):
+        for name in ["ivf", "brute_ivf"]:
+            db.execute(f"insert into {name}(rowid, a) values (?, ?)", [i, _f32(vectors[i])])
+        if i == 200:
+            db.execute("insert into ivf(ivf) values ('ivf-train')")
+    for query in centers[:3]:
+        assert execute_all(
+            db, knn.format("ivf", "and k = 10"), [_f32(query)]
+        ) == execute_all(db, knn.format("brute_ivf", "and k = 10"), [_f32(query)])
+    for row in db.execute("select bounds from ivf_chunk_bounds00"):
+        assert struct.unpack("4ffI", row[0])[5] > 0
+
+    db.execute("drop table v")
+    assert execute_all(
+        db, "select name from sqlite_master where name glob 'v_*' and name not glob 'v_l1*'"
+    ) == []
+
+
+def test_vec0_ivf():
+    for column in [
+        "a float[2] index=ivf(nlist=0)",
+        "a float[2] index=ivf(nlist=65537)",
+        "a float[2] index=ivf(nprobe=2)",
+        "a float[2] index=ivf(nlist=4, foo=1)",
+        "a float[2] index=ivf",
+        "a float[2] index=foo",
+        "a bit[8] index=ivf(nlist=4)",
+    ]:
+        with _raises(f"vec0 constructor error: could not parse vector column '{column}'"):
+            connect(EXT_PATH).execute(f"create virtual table v using vec0({column})")
+    with _raises(
+        "vec0 constructor error: Only one vector column can have an ivf index"
+    ):
+        connect(EXT_PATH).execute(
+            "create virtual table v using vec0(a float[2] index=ivf(nlist=2), b float[2] index=ivf(nlist=2))"
+        )
+
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(p text partition key, n integer, s text, a float[2] index=ivf(nlist=4, nprobe=1), chunk_size=8)"
+    )
+    db.execute(
+        "create virtual table brute using vec0(p text partition key, n integer, s text, a float[2], chunk_size=8)"
+    )
+    centers = [[0, 0], [100, 0], [0, 100], [100, 100]]
+    for i in range(1, 101):
+        vector = _f32([centers[i % 4][0] + i / 10, centers[i % 4][1] + i % 5])
+        for table in ["v", "brute"]:
+            db.execute(
+                f"insert into {table}(rowid, p, n, s, a) values (?, ?, ?, ?, ?)",
+                [i, "abc"[i % 3], i, f"a text value longer than 12 bytes {i}", vector],
+            )
+
+    knn = "select rowid, distance from {} where a match ? and k = ? {}"
+
+    # rows at equal distances are returned in chunk order, which differs
+    # once rows are moved to the chunks of their list
+    def results(query, k, where=""):
+        rows = execute_all(db, knn.format("v", where), [_f32(query), k])
+        return sorted(rows, key=lambda row: (row["distance"], row["rowid"]))
+
+    def expected(query, k, where=""):
+        rows = execute_all(
+            db,
+            knn.format("brute", where.replace("and nprobe = 4", "")),
+            [_f32(query), k],
+        )
+        return sorted(rows, key=lambda row: (row["distance"], row["rowid"]))
+
+    # untrained, every row is scanned
+    assert results([100, 0], 10) == expected([100, 0], 10)
+
+    with _raises("Unknown vec0 command 'nope'"):
+        db.execute("insert into v(v) values ('nope')")
+    with _raises("nprobe value in knn queries must be greater than 0."):
+        db.execute(knn.format("v", "and nprobe = 0"), [_f32([0, 0]), 1])
+    with _raises('A value was provided for the hidden "nprobe" column.'):
+        db.execute("insert into v(a, nprobe) values ('[1, 1]', 1)")
+
+    db.execute("insert into v(v) values ('ivf-train')")
+    assert execute_all(
+        db, "select centroid_id, vec_to_json(centroid) as c from v_ivf_centroids00"
+    ) == [
+        {"centroid_id": 1, "c": "[104.900002,2.000000]"},
+        {"centroid_id": 2, "c": "[5.000000,102.000000]"},
+        {"centroid_id": 3, "c": "[105.099998,102.000000]"},
+        {"centroid_id": 4, "c": "[5.200000,2.000000]"},
+    ]
+    # every chunk holds rows of a single list and partition
+    assert db.execute(
+        "select count(*) from v_chunks where ivf_list is null"
+    ).fetchone()[0] == 0
+    assert db.execute(
+        "select count(distinct ivf_list || partition00) from v_chunks"
+    ).fetchone()[0] == 12
+
+    # nprobe=1 finds the rows of the nearest cluster, probing every list is
+    # the same as a brute-force query
+    for query in [[100, 0], [1, 99], [50, 50]]:
+        for where in ["and nprobe = 4", "and nprobe = 4 and p = 'a'", "and nprobe = 4 and n > 50"]:
+            assert results(query, 20, where) == expected(query, 20, where)
+    assert results([100, 0], 25) == expected([100, 0], 25)
+    assert len(results([100, 0], 40)) == 25
+    assert len(results([100, 0], 40, "and p = 'b'")) == 9
+
+    # moved rows keep their metadata and partition values
+    assert execute_all(
+        db, "select rowid, p, n, s, vec_to_json(a) as a from v order by rowid"
+    ) == execute_all(
+        db, "select rowid, p, n, s, vec_to_json(a) as a from brute order by rowid"
+    )
+
+    # new and updated rows go to the list of their nearest centroid
+    db.execute("insert into v(rowid, p, n, s, a) values (1000, 'a', 0, '', '[101, 1]')")
+    db.execute("update v set a = '[101, 1.5]' where rowid = 4")
+    assert [row["rowid"] for row in results([101, 1], 2)] == [1000, 4]
+    assert db.execute(
+        "select count(*) from v_chunks where ivf_list is null"
+    ).fetchone()[0] == 0
+
+    # training again renumbers the lists
+    db.execute("insert into v(v) values ('ivf-train')")
+    assert execute_all(
+        db, "select min(centroid_id) as min, max(centroid_id) as max from v_ivf_centroids00"
+    ) == [{"min": 5, "max": 8}]
+    assert db.execute("select min(ivf_list) from v_chunks").fetchone()[0] >= 5
+    assert db.execute("select count(*) from v").fetchone()[0] == 101
+
+    with _raises("Cannot train the ivf index of an empty table."):
+        db.execute(
+            "create virtual table empty using vec0(a float[2] index=ivf(nlist=4))"
+        )
+        db.execute("insert into empty(empty) values ('ivf-train')")
+
+
+def test_vec0_hnsw():
+    for column in [
+        "a float[2] index=hnsw(m=1)",
+        "a float[2] index=hnsw(m=129)",
+        "a float[2] index=hnsw(ef_search=0)",
+        "a float[2] index=hnsw(ef_construction=4097)",
+        "a float[2] index=hnsw(m=4, foo=1)",
+        "a float[2] index=hnsw index=ivf(nlist=2)",
+        "a bit[8] index=hnsw",
+    ]:
+        with _raises(f"vec0 constructor error: could not parse vector column '{column}'"):
+            connect(EXT_PATH).execute(f"create virtual table v using vec0({column})")
+
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(p text partition key, n integer, a float[2] index=hnsw(m=4, ef_construction=32, ef_search=16), chunk_size=8)"
+    )
+    db.execute(
+        "create virtual table brute using vec0(p text partition key, n integer, a float[2], chunk_size=8)"
+    )
+    assert db.execute(
+        "select count(*) from sqlite_master where name = 'v_hnsw_nodes00'"
+    ).fetchone()[0] == 1
+
+    # no graph yet
+    assert execute_all(db, "select rowid from v where a match '[0, 0]' and k = 3") == []
+
+    for i in range(1, 201):
+        vector = _f32([(i * 37) % 101, i / 10])
+        for table in ["v", "brute"]:
+            db.execute(
+                f"insert into {table}(rowid, p, n, a) values (?, ?, ?, ?)",
+                [i, "ab"[i % 2], i % 5, vector],
+            )
+    assert db.execute("select count(*) from v_hnsw_nodes00").fetchone()[0] == 200
+
+    knn = "select rowid, distance from {} where a match ? and k = ? {}"
+
+    def results(query, k, where=""):
+        return execute_all(db, knn.format("v", where), [_f32(query), k])
+
+    def expected(query, k, where=""):
+        where = where.replace("and ef_search = 500", "")
+        return execute_all(db, knn.format("brute", where), [_f32(query), k])
+
+    # with a beam as wide as the table, searches are exact
+    for query in [[0, 0], [50, 10], [100, 20], [33, 3]]:
+        for where in [
+            "and ef_search = 500",
+            "and ef_search = 500 and p = 'a'",
+            "and ef_search = 500 and n = 3",
+            "and ef_search = 500 and n in (1, 2)",
+            "and ef_search = 500 and distance < 20",
+        ]:
+            assert results(query, 10, where) == expected(query, 10, where)
+    # as are filtered queries that leave fewer rows than the beam
+    assert results([50, 10], 5, "and rowid in (1, 2, 3, 4, 5, 6, 7)") == expected(
+        [50, 10], 5, "and rowid in (1, 2, 3, 4, 5, 6, 7)"
+    )
+    # the default beam finds most of the true neighbors
+    found = 0
+    for x in range(0, 100, 10):
+        found += len(
+            {row["rowid"] for row in results([x, x / 5], 10)}
+            & {row["rowid"] for row in expected([x, x / 5], 10)}
+        )
+    assert found >= 90
+    # queries without k, or with a large one, scan every row
+    assert execute_all(
+        db, "select rowid from v where a match '[0, 0]' and distance < 5"
+    ) == execute_all(
+        db, "select rowid from brute where a match '[0, 0]' and distance < 5"
+    )
+    assert results([0, 0], 5000) == expected([0, 0], 5000)
+
+    with _raises("ef_search value in knn queries must be greater than 0."):
+        db.execute(knn.format("v", "and ef_search = 0"), [_f32([0, 0]), 1])
+    with _raises('A value was provided for the hidden "ef_search" column.'):
+        db.execute("insert into v(a, ef_search) values ('[1, 1]', 1)")
+
+    # deleted rows stay in the graph as tombstones, but are never returned
+    for i in range(1, 101):
+        db.execute("delete from v where rowid = ?", [i])
+        db.execute("delete from brute where rowid = ?", [i])
+    assert execute_all(
+        db, "select count(*) as count, sum(deleted) as deleted from v_hnsw_nodes00"
+    ) == [{"count": 200, "deleted": 100}]
+    for query in [[0, 0], [50, 10], [100, 20]]:
+        assert results(query, 10, "and ef_search = 500") == expected(query, 10)
+        assert min(row["rowid"] for row in results(query, 10)) > 100
+
+    # updated vectors and re-used rowids replace their node
+    db.execute("update v set a = '[500, 500]' where rowid = 150")
+    db.execute("insert into v(rowid, p, n, a) values (1, 'a', 0, '[-500, -500]')")
+    for query, rowid in [([500, 500], 150), ([-500, -500], 1)]:
+        assert results(query, 1, "and ef_search = 500") == [
+            {"rowid": rowid, "distance": 0.0}
+        ]
+    assert execute_all(
+        db, "select count(*) as count, sum(deleted) as deleted from v_hnsw_nodes00"
+    ) == [{"count": 200, "deleted": 99}]
+
+    # links pruned from full neighbor lists can leave nodes unreachable, so
+    # queries whose beam covers the whole table scan it instead
+    db.execute(
+        "create virtual table narrow using vec0(a float[4] index=hnsw(m=2, ef_construction=4))"
+    )
+
+    def vector(i):
+        return _f32([(i * 37) % 101, (i * 53) % 97, (i * 11) % 89, (i * 7) % 83])
+
+    for i in range(1, 113):
+        db.execute("insert into narrow(rowid, a) values (?, ?)", [i, vector(i)])
+    for i in range(1, 113, 3):
+        db.execute("update narrow set a = ? where rowid = ?", [vector(i + 200), i])
+    assert (
+        len(execute_all(db, "select rowid from narrow where a match ? and k = 1000", [vector(0)]))
+        == 112
+    )
+    # graph searches that reach fewer than k rows scan the table instead
+    for i in range(0, 113, 7):
+        for constraint in ["", "and distance < 1000"]:
+            assert (
+                len(
+                    execute_all(
+                        db,
+                        f"select rowid from narrow where a match ? and k = 100 and ef_search = 100 {constraint}",
+                        [vector(i)],
+                    )
+                )
+                == 100
+            )
+
+    # a replaced node never links to itself, and a replaced entry point hands
+    # over to a node of the top level
+    def links(neighbors, level, m=2):
+        ids = struct.unpack("%dq" % (len(neighbors) // 8), neighbors)
+        result, offset = [], 0
+        for l in range(level + 1):
+            result += ids[offset + 1 : offset + 1 + ids[offset]]
+            offset += 1 + (2 * m if l == 0 else m)
+        return result
+
+    for i in range(1, 113, 5):
+        entry = db.execute(
+            "select value from narrow_info where key = 'hnsw_entry_point00'"
+        ).fetchone()[0]
+        for rowid in [entry, i]:
+            db.execute(
+                "update narrow set a = ? where rowid = ?", [vector(rowid + 300), rowid]
+            )
+        assert (
+            len(
+                execute_all(
+                    db,
+                    "select rowid from narrow where a match ? and k = 112 and ef_search = 112",
+                    [vector(0)],
+                )
+            )
+            == 112
+        )
+    nodes = execute_all(db, "select rowid, level, neighbors from narrow_hnsw_nodes00")
+    entry = db.execute(
+        "select value from narrow_info where key = 'hnsw_entry_point00'"
+    ).fetchone()[0]
+    assert {row["level"] for row in nodes if row["rowid"] == entry} == {
+        max(row["level"] for row in nodes)
+    }
+    for row in nodes:
+        assert row["rowid"] not in links(row["neighbors"], row["level"])
+
+
+# Checks KNN queries on a table "v" whose vector column is declared as
+# `column` plus `index` options, like a quantizer or a graph index, against a
+# brute-force table "brute" of the same rows: before and after `train`, with
+# filters, and after deletes and updates. `exact` is added to the queries on
+# "v" that must return exact results, like an ef_search as wide as the table.
+# Returns the connection, with both tables left in place.
+def _check_vec0_knn(column, index, train, vector, exact=""):
+    db = connect(EXT_PATH)
+    for table, options in [("v", index), ("brute", "")]:
+        db.execute(
+            f"create virtual table {table} using vec0(p text partition key, n integer, {column} {options}, chunk_size=8)"
+        )
+
+    knn = "select rowid, distance from {} where a match ? and k = ? {}"
+
+    def results(query, k, where=""):
+        return execute_all(db, knn.format("v", where + " " + exact), [_f32(query), k])
+
+    def expected(query, k, where=""):
+        return execute_all(db, knn.format("brute", where), [_f32(query), k])
+
+    def insert(start, end):
+        for i in range(start, end):
+            for table in ["v", "brute"]:
+                db.execute(
+                    f"insert into {table}(rowid, p, n, a) values (?, ?, ?, ?)",
+                    [i, "ab"[i % 2], i % 5, _f32(vector(i))],
+                )
+
+    # until the index is trained, queries scan every vector
+    insert(1, 101)
+    assert results(vector(3), 10) == expected(vector(3), 10)
+
+    db.execute(f"insert into v(v) values ('{train}')")
+    # rows inserted after training are added too
+    insert(101, 201)
+
+    for query in [vector(3), vector(150), [0.5] * len(vector(1))]:
+        radius = expected(query, 5)[-1]["distance"]
+        for where in [
+            "",
+            "and p = 'a'",
+            "and n = 3",
+            "and n in (1, 2)",
+            f"and distance < {radius}",
+            "and rowid in (1, 2, 3, 4, 5, 6, 7)",
+        ]:
+            assert results(query, 10, where) == expected(query, 10, where)
+    # queries with a large k scan every vector
+    assert results(vector(3), 5000) == expected(vector(3), 5000)
+
+    # deleted rows are never returned, updated rows are added again
+    for i in range(1, 101):
+        for table in ["v", "brute"]:
+            db.execute(f"delete from {table} where rowid = ?", [i])
+    assert results(vector(150), 10) == expected(vector(150), 10)
+    far = [500] * len(vector(1))
+    for table in ["v", "brute"]:
+        db.execute(f"update {table} set a = ? where rowid = 150", [_f32(far)])
+    assert results(far, 1) == expected(far, 1)
+    assert expected(far, 1)[0]["rowid"] == 150
+    return db
+
+
+# Fraction of the true k nearest rows by l2 distance that KNN queries on
+# table "v" return, where row i + 1 of "v" holds vectors[i].
+def _vec0_knn_recall(db, vectors, queries, where="", k=10):
+    found = 0
+    for query in queries:
+        distances = ((vectors - query) ** 2).sum(axis=1)
+        expected = set((np.argsort(distances)[:k] + 1).tolist())
+        rows = db.execute(
+            f"select rowid, distance from v where a match ? and k = ? {where}",
+            [query.tobytes(), k],
+        ).fetchall()
+        # candidates may be ranked approximately, but distances are exact
+        for rowid, distance in rows:
+            assert isclose(distance, distances[rowid - 1] ** 0.5, rel_tol=1e-4)
+        found += len(expected & {row[0] for row in rows})
+    return found / (k * len(queries))
+
+
+# KNN recall of a table of `vectors` declared as `column`, after `train`.
+def _vec0_trained_knn_recall(column, train, vectors, queries, where=""):
+    db = connect(EXT_PATH)
+    db.execute(f"create virtual table v using vec0({column})")
+    for i, vector in enumerate(vectors):
+        db.execute("insert into v(rowid, a) values (?, ?)", [i + 1, vector.tobytes()])
+    db.execute(f"insert into v(v) values ('{train}')")
+    return _vec0_knn_recall(db, vectors, queries, where)
+
+
+def test_vec0_diskann():
+    for column in [
+        "a float[2] index=diskann(r=1)",
+        "a float[2] index=diskann(r=257)",
+        "a float[2] index=diskann(ef_search=0)",
+        "a float[2] index=diskann(l=4097)",
+        "a float[2] index=diskann(ef_search=4097)",
+        "a float[2] index=diskann(pq_subvectors=3)",
+        "a float[2] index=diskann(r=4, foo=1)",
+        "a float[2] index=diskann index=hnsw",
+        "a bit[8] index=diskann",
+    ]:
+        with _raises(f"vec0 constructor error: could not parse vector column '{column}'"):
+            connect(EXT_PATH).execute(f"create virtual table v using vec0({column})")
+
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[2] index=diskann)")
+    assert execute_all(
+        db,
+        "select name from sqlite_master where name in ('v_pq_codebooks00', 'v_diskann_nodes00') order by name",
+    ) == [{"name": "v_diskann_nodes00"}, {"name": "v_pq_codebooks00"}]
+    with _raises("Cannot train the diskann index of an empty table."):
+        db.execute("insert into v(v) values ('diskann-train')")
+    with _raises("Unknown vec0 command 'ivf-train'"):
+        db.execute("insert into v(v) values ('ivf-train')")
+
+    def vector(i):
+        return [(i * 37) % 101, i / 10]
+
+    # with a beam as wide as the table, searches are exact
+    db = _check_vec0_knn(
+        "a float[2]",
+        "index=diskann(r=8, l=32, ef_search=16)",
+        "diskann-train",
+        vector,
+        exact="and ef_search = 500",
+    )
+    assert db.execute("select count(*) from v_pq_codebooks00").fetchone()[0] == 1
+    # deleted rows stay in the graph as tombstones
+    assert execute_all(
+        db,
+        "select count(*) as count, sum(deleted) as deleted from v_diskann_nodes00",
+    ) == [{"count": 200, "deleted": 100}]
+
+    knn = "select rowid, distance from v where a match ? and k = ? {}"
+
+    def results(query, k, where=""):
+        return execute_all(db, knn.format(where), [_f32(query), k])
+
+    with _raises("ef_search value in knn queries must be greater than 0."):
+        db.execute(knn.format("and ef_search = 0"), [_f32([0, 0]), 1])
+    with _raises('A value was provided for the hidden "ef_search" column.'):
+        db.execute("insert into v(a, ef_search) values ('[1, 1]', 1)")
+
+    # re-used rowids replace their node
+    db.execute("insert into v(rowid, p, n, a) values (1, 'a', 0, '[-500, -500]')")
+    assert results([-500, -500], 1, "and ef_search = 500") == [
+        {"rowid": 1, "distance": 0.0}
+    ]
+
+    # re-training rebuilds the graph from the live rows only
+    db.execute("insert into v(v) values ('diskann-train')")
+    assert execute_all(
+        db,
+        "select count(*) as count, sum(deleted) as deleted from v_diskann_nodes00",
+    ) == [{"count": 101, "deleted": 0}]
+    assert results([500, 500], 1, "and ef_search = 500") == [
+        {"rowid": 150, "distance": 0.0}
+    ]
+
+    # links pruned from full neighbor lists can leave nodes unreachable, so
+    # queries whose beam covers the whole table scan it instead
+    db.execute(
+        "create virtual table narrow using vec0(a float[4] index=diskann(r=4, l=8))"
+    )
+
+    def vector(i):
+        return _f32([(i * 37) % 101, (i * 53) % 97, (i * 11) % 89, (i * 7) % 83])
+
+    for i in range(1, 21):
+        db.execute("insert into narrow(rowid, a) values (?, ?)", [i, vector(i)])
+    db.execute("insert into narrow(narrow) values ('diskann-train')")
+    for i in range(21, 113):
+        db.execute("insert into narrow(rowid, a) values (?, ?)", [i, vector(i)])
+    for i in range(1, 113, 3):
+        db.execute("update narrow set a = ? where rowid = ?", [vector(i + 200), i])
+    assert (
+        len(execute_all(db, "select rowid from narrow where a match ? and k = 1000", [vector(0)]))
+        == 112
+    )
+
+
+def test_vec0_diskann_recall():
+    # a table many times larger than ef_search, so queries walk the graph
+    rng = np.random.default_rng(1)
+    vectors = rng.standard_normal((3500, 64)).astype(np.float32)
+    queries = rng.standard_normal((50, 64)).astype(np.float32)
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(a float[64] index=diskann(pq_subvectors=16))"
+    )
+
+    def insert(start, end):
+        for i in range(start, end):
+            db.execute(
+                "insert into v(rowid, a) values (?, ?)", [i + 1, vectors[i].tobytes()]
+            )
+
+    def recall(ef_search, n):
+        return _vec0_knn_recall(
+            db, vectors[:n], queries, f"and ef_search = {ef_search}"
+        )
+
+    def unreachable():
+        entry = db.execute(
+            "select value from v_info where key = 'diskann_entry_point00'"
+        ).fetchone()[0]
+        neighbors = {}
+        for rowid, blob in db.execute("select rowid, neighbors from v_diskann_nodes00"):
+            count = struct.unpack_from("<q", blob)[0]
+            neighbors[rowid] = struct.unpack_from(f"<{count}q", blob, 8)
+        seen = {entry}
+        stack = [entry]
+        while stack:
+            for neighbor in neighbors[stack.pop()]:
+                if neighbor not in seen:
+                    seen.add(neighbor)
+                    stack.append(neighbor)
+        return len(neighbors) - len(seen)
+
+    insert(0, 3000)
+    db.execute("insert into v(v) values ('diskann-train')")
+    assert unreachable() == 0
+    assert recall(32, 3000) >= 0.78
+    assert recall(64, 3000) >= 0.94
+
+    # rows inserted after training are linked into the same graph
+    insert(3000, 3500)
+    assert recall(64, 3500) >= 0.9
+
+
+def test_vec0_quantizer_pq():
+    for column in [
+        "a float[2] quantizer=foo",
+        "a float[2] quantizer=pq(subvectors=3)",
+        "a float[2] quantizer=pq(foo=1)",
+        "a float[2] quantizer=pq quantizer=pq",
+        "a float[2] quantizer=pq index=hnsw",
+        "a float[2] quantizer=pq rerank=0",
+        "a float[2] quantizer=pq rerank=1001",
+        "a float[2] rerank=4",
+        "a float16[2] quantizer=pq",
+        "a bit[8] quantizer=pq",
+    ]:
+        with _raises(f"vec0 constructor error: could not parse vector column '{column}'"):
+            connect(EXT_PATH).execute(f"create virtual table v using vec0({column})")
+
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[4] quantizer=pq)")
+    assert execute_all(
+        db,
+        "select name from sqlite_master where name in ('v_pq_codebooks00', 'v_quantized_chunks00') order by name",
+    ) == [{"name": "v_pq_codebooks00"}, {"name": "v_quantized_chunks00"}]
+    with _raises("Cannot train the quantizer of an empty table."):
+        db.execute("insert into v(v) values ('quantizer-train')")
+    with _raises("Unknown vec0 command 'diskann-train'"):
+        db.execute("insert into v(v) values ('diskann-train')")
+
+    def vector(i):
+        return [(i * 37) % 101, i / 10, (i * 13) % 7, i % 3]
+
+    # with k * rerank candidates covering the table, results are exact
+    db = _check_vec0_knn(
+        "a float[4]", "quantizer=pq(subvectors=2) rerank=100", "quantizer-train", vector
+    )
+    assert db.execute("select count(*) from v_pq_codebooks00").fetchone()[0] == 2
+
+    # re-training encodes every row again
+    db.execute("insert into v(v) values ('quantizer-train')")
+    knn = "select rowid, distance from {} where a match ? and k = 10"
+    for query in [vector(160), [500] * 4]:
+        assert execute_all(db, knn.format("v"), [_f32(query)]) == execute_all(
+            db, knn.format("brute"), [_f32(query)]
+        )
+
+    # with k * rerank far below the number of rows, most true neighbors are
+    # still found, and more of them with more subvectors or a larger rerank
+    rng = np.random.default_rng(1)
+    vectors = rng.standard_normal((2000, 32)).astype(np.float32)
+    queries = rng.standard_normal((50, 32)).astype(np.float32)
+
+    def recall(subvectors, rerank):
+        return _vec0_trained_knn_recall(
+            f"a float[32] quantizer=pq(subvectors={subvectors}) rerank={rerank}",
+            "quantizer-train",
+            vectors,
+            queries,
+        )
+
+    baseline = recall(4, 2)
+    assert baseline >= 0.5
+    assert recall(8, 2) >= baseline + 0.2
+    assert recall(4, 8) >= baseline + 0.2
+
+
+def test_vec0_quantizer_binary():
+    for column in [
+        "a float[12] quantizer=binary",
+        "a float[8] quantizer=binary(rerank=2)",
+        "a float[8] quantizer=binary index=diskann",
+        "a int8[8] quantizer=binary",
+    ]:
+        with _raises(f"vec0 constructor error: could not parse vector column '{column}'"):
+            connect(EXT_PATH).execute(f"create virtual table v using vec0({column})")
+
+    def vector(i):
+        return list(np.random.default_rng(i).uniform(-1, 1, 8))
+
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[8] quantizer=binary)")
+    # sign bits need no codebooks
+    assert execute_all(
+        db,
+        "select name from sqlite_master where name like 'v_pq%' or name like 'v_quantized%'",
+    ) == [{"name": "v_quantized_chunks00"}]
+    # codes are written on insert, the same as vec_quantize_binary()
+    for i in range(1, 9):
+        db.execute("insert into v(rowid, a) values (?, ?)", [i, _f32(vector(i))])
+    codes = db.execute("select codes from v_quantized_chunks00").fetchone()[0]
+    for i in range(1, 9):
+        assert codes[i - 1 : i] == db.execute(
+            "select vec_quantize_binary(?)", [_f32(vector(i))]
+        ).fetchone()[0]
+
+    # with k * rerank candidates covering the table, results are exact, and
+    # 'quantizer-train' has nothing to do
+    db = _check_vec0_knn(
+        "a float[8]", "quantizer=binary rerank=100", "quantizer-train", vector
+    )
+
+    db.execute("drop table v")
+    assert execute_all(
+        db, "select name from sqlite_master where name like 'v_%'"
+    ) == []
+
+    # with fewer candidates than rows, ranking on sign bits finds most of the
+    # true neighbors
+    rng = np.random.default_rng(1)
+    vectors = rng.standard_normal((2000, 64)).astype(np.float32)
+    queries = rng.standard_normal((50, 64)).astype(np.float32)
+    recalls = [
+        _vec0_trained_knn_recall(
+            f"a float[64] quantizer=binary rerank={rerank}",
+            "quantizer-train",
+            vectors,
+            queries,
+        )
+        for rerank in [8, 64]
+    ]
+    assert recalls[0] >= 0.4
+    assert recalls[1] >= 0.85
+    assert recalls[1] > recalls[0]
+
+
+def test_vec0_quantizer_int8():
+    for column in [
+        "a float[4] quantizer=int8(x=1)",
+        "a float[4] quantizer=int8 index=hnsw",
+        "a int8[4] quantizer=int8",
+    ]:
+        with _raises(f"vec0 constructor error: could not parse vector column '{column}'"):
+            connect(EXT_PATH).execute(f"create virtual table v using vec0({column})")
+
+    db = connect(EXT_PATH)
+    db.execute("create virtual table v using vec0(a float[8] quantizer=int8)")
+    # scales instead of PQ codebooks
+    assert execute_all(
+        db,
+        "select name from sqlite_master where name like 'v_%' and name not like 'v_%chunks%' order by name",
+    ) == [
+        {"name": "v_info"},
+        {"name": "v_int8_scales00"},
+        {"name": "v_rowids"},
+    ]
+    with _raises("Cannot train the quantizer of an empty table."):
+        db.execute("insert into v(v) values ('quantizer-train')")
+
+    def vector(i):
+        # every dimension has its own range
+        rng = np.random.default_rng(i)
+        return [x * (j + 1) + j for j, x in enumerate(rng.uniform(-1, 1, 8))]
+
+    # with k * rerank candidates covering the table, results are exact
+    for metric in ["cosine", "l1", "dot", "l2"]:
+        db = _check_vec0_knn(
+            f"a float[8] distance_metric={metric}",
+            "quantizer=int8 rerank=100",
+            "quantizer-train",
+            vector,
+        )
+    scales, offsets = db.execute("select scales, offsets from v_int8_scales00").fetchone()
+    assert len(scales) == len(offsets) == 8 * 4
+    codes = db.execute("select codes from v_quantized_chunks00 limit 1").fetchone()[0]
+    assert len(codes) == 8 * (8 + 4)
+
+    # training again picks up the range of the updated row
+    db.execute("insert into v(v) values ('quantizer-train')")
+    assert db.execute("select scales from v_int8_scales00").fetchone()[0] != scales
+    knn = "select rowid, distance from {} where a match ? and k = 10"
+    assert execute_all(db, knn.format("v"), [_f32(vector(160))]) == execute_all(
+        db, knn.format("brute"), [_f32(vector(160))]
+    )
+
+    db.execute("drop table v")
+    assert execute_all(db, "select name from sqlite_master where name like 'v_%'") == []
+
+    # with k * rerank far below the number of rows, int8 codes of dimensions
+    # with very different ranges still rank nearly all true neighbors first
+    rng = np.random.default_rng(1)
+    scale = np.arange(1, 33, dtype=np.float32)
+    vectors = (rng.standard_normal((2000, 32)) * scale + scale).astype(np.float32)
+    queries = (rng.standard_normal((50, 32)) * scale + scale).astype(np.float32)
+
+    def recall(rerank):
+        return _vec0_trained_knn_recall(
+            f"a float[32] quantizer=int8 rerank={rerank}",
+            "quantizer-train",
+            vectors,
+            queries,
+        )
+
+    assert recall(1) >= 0.95
+    assert recall(2) >= 0.99
+
+
+def test_vec0_quantizer_mixed_columns():
+    # training skips the vector columns that have no quantizer to train
+    for columns in [
+        "a float[8], b float[8] quantizer=pq",
+        "a float[8] quantizer=int8, b float[8]",
+        "a float[8] index=hnsw, b float[8] quantizer=int8",
+        "a float[8] index=ivf(nlist=2), b float[8] quantizer=pq",
+        "a float[8] index=ivf(nlist=2), b float[8] quantizer=int8",
+        "a float[8] index=diskann, b float[8] quantizer=pq",
+        "a float[8] index=diskann, b float[8] quantizer=int8",
+        "a float[8] quantizer=binary, b float[8] quantizer=int8",
+    ]:
+        db = connect(EXT_PATH)
+        db.execute(f"create virtual table v using vec0({columns}, chunk_size=8)")
+        db.execute(
+            "create virtual table brute using vec0(a float[8], b float[8], chunk_size=8)"
+        )
+        for i in range(1, 41):
+            rng = np.random.default_rng(i)
+            a, b = _f32(list(rng.uniform(-1, 1, 8))), _f32(list(rng.uniform(-1, 1, 8)))
+            for table in ["v", "brute"]:
+                db.execute(
+                    f"insert into {table}(rowid, a, b) values (?, ?, ?)", [i, a, b]
+                )
+        db.execute("insert into v(v) values ('quantizer-train')")
+        for column in ["a", "b"]:
+            sql = f"select rowid, distance from {{}} where {column} match ? and k = 5"
+            query = _f32([0.5] * 8)
+            assert execute_all(db, sql.format("v"), [query]) == execute_all(
+                db, sql.format("brute"), [query]
+            )
+
+
+def test_vec0_half_types():
+    db = connect(EXT_PATH)
+    db.execute(
+        "create virtual table v using vec0(a float16[2], b bfloat16[2] distance_metric=cosine, c f16[2] distance_metric=dot, chunk_size=8)"
+    )
+    # float32 JSON and BLOB input is converted on write
+    db.execute("insert into v(rowid, a, b, c) values (1, '[1, 2]', '[1, 2]', '[1, 2]')")
+    db.execute(
+        "insert into v(rowid, a, b, c) values (2, ?, ?, ?)",
+        [_f32([3, 4]), _f32([3, 4]), _f32([3, 4])],
+    )
+    db.execute(
+        "insert into v(rowid, a, b, c) values (3, vec_f16('[5, 6]'), vec_bf16('[5, 6]'), vec_f16('[5, 6]'))"
+    )
+
+    # 2 bytes per element
+    assert len(
+        db.execute("select vectors from v_vector_chunks00").fetchone()[0]
+    ) == 8 * 2 * 2
+
+    assert execute_all(db, "select rowid, a, b, c from v where rowid = 2") == [
+        {"rowid": 2, "a": _f16([3, 4]), "b": _bf16([3, 4]), "c": _f16([3, 4])},
+    ]
+    assert execute_all(
+        db, "select vec_type(a) as a, vec_type(b) as b from v where rowid = 1"
+    ) == [{"a": "float16", "b": "bfloat16"}]
+
+    q = "[-1, -2]"
+    assert execute_all(
+        db, "select rowid, distance from v where a match ? and k = 3", [q]
+    ) == [
+        {"rowid": 1, "distance": 4.4721360206604},
+        {"rowid": 2, "distance": 7.211102485656738},
+        {"rowid": 3, "distance": 10.0},
+    ]
+    assert execute_all(
+        db, "select rowid, distance from v where b match vec_bf16(?) and k = 3", [q]
+    ) == [
+        {"rowid": 3, "distance": 1.9734171628952026},
+        {"rowid": 2, "distance": 1.9838699102401733},
+        {"rowid": 1, "distance": 2},
+    ]
+    assert execute_all(
+        db, "select rowid, distance from v where c match ? and k = 3", [q]
+    ) == [
+        {"rowid": 1, "distance": 5},
+        {"rowid": 2, "distance": 11},
+        {"rowid": 3, "distance": 17},
+    ]
+
+    db.execute("update v set a = '[0.5, 0.25]' where rowid = 3")
+    assert db.execute("select vec_to_json(a) from v where rowid = 3").fetchone()[0] == "[0.500000,0.250000]"
+
+    with _raises(
+        'Inserted vector for the "a" column is expected to be of type float16, but a int8 vector was provided.'
+    ):
+        db.execute(
+            "insert into v(rowid, a, b, c) values (4, vec_int8('[1, 2]'), '[1, 2]', '[1, 2]')"
+        )
+    with _raises(
+        'Query vector for the "a" column is expected to be of type float16, but a bfloat16 vector was provided.'
+    ):
+        db.execute("select rowid from v where a match vec_bf16(?) and k = 3", [q])
 
 
 def test_vec0_vacuum():
@@ -1,4 +1,5 @@
 #include "../sqlite-vec.h"
+#include "sqlite-vec-internal.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -48,7 +49,107 @@ void test_vec0_parse_partition_key_definition() {
   }
 }
 
+void test_bitmap() {
+  printf("Starting %s...\n", __func__);
+  // sizes that are a whole number of 64 bit words, and ones that aren't
+  int32_t sizes[] = {8, 64, 72, 200};
+  for(int s = 0; s < countof(sizes); s++) {
+    int32_t n = sizes[s];
+    uint8_t *a = bitmap_new(n);
+    uint8_t *b = bitmap_new(n);
+    assert(bitmap_is_empty(a, n));
+    assert(bitmap_count(a, n) == 0);
+    assert(bitmap_next(a, n, 0) == n);
+
+    for(int32_t i = 0; i < n; i += 3) {
+      bitmap_set(a, i, 1);
+    }
+    bitmap_set(a, n - 1, 1);
+    for(int32_t i = 0; i < n; i += 2) {
+      bitmap_set(b, i, 1);
+    }
+    assert(!bitmap_is_empty(a, n));
+
+    // bitmap_next() visits exactly the set bits, in order
+    int32_t expected = 0;
+    int32_t count = 0;
+    for(int32_t i = bitmap_next(a, n, 0); i < n; i = bitmap_next(a, n, i + 1)) {
+      while(!bitmap_get(a, expected)) expected++;
+      assert(i == expected);
+      expected++;
+      count++;
+    }
+    assert(count == bitmap_count(a, n));
+    assert(bitmap_next(a, n, n - 1) == n - 1);
+
+    bitmap_and_inplace(a, b, n);
+    for(int32_t i = 0; i < n; i++) {
+      assert(bitmap_get(a, i) == ((i % 3 == 0 || i == n - 1) && i % 2 == 0));
+    }
+    bitmap_or_inplace(a, b, n);
+    for(int32_t i = 0; i < n; i++) {
+      assert(bitmap_get(a, i) == (i % 2 == 0));
+    }
+    bitmap_andnot_inplace(a, b, n);
+    assert(bitmap_is_empty(a, n));
+
+    sqlite3_free(a);
+    sqlite3_free(b);
+    printf("✅ bitmap of %d bits\n", n);
+  }
+}
+
+void test_knn_early_abandon() {
+  printf("Starting %s...\n", __func__);
+  // rows far from the query pass the k-th best distance long before their
+  // last dimension, so a k much smaller than the table abandons some of them
+  const char *metrics[] = {"l2", "l1"};
+  for(int m = 0; m < countof(metrics); m++) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    char sql[256];
+    float vector[256];
+    assert(sqlite3_open(":memory:", &db) == SQLITE_OK);
+    assert(sqlite3_vec_init(db, NULL, NULL) == SQLITE_OK);
+    snprintf(sql, sizeof(sql),
+      "create virtual table v using vec0(a float[256] distance_metric=%s, chunk_size=8)",
+      metrics[m]);
+    assert(sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK);
+
+    assert(sqlite3_prepare_v2(db, "insert into v(rowid, a) values (?, ?)", -1, &stmt, NULL) == SQLITE_OK);
+    for(int i = 1; i <= 64; i++) {
+      for(int j = 0; j < 256; j++) {
+        vector[j] = (float) i + (float) (j % 7) / 10;
+      }
+      sqlite3_bind_int64(stmt, 1, i);
+      sqlite3_bind_blob(stmt, 2, vector, sizeof(vector), SQLITE_STATIC);
+      assert(sqlite3_step(stmt) == SQLITE_DONE);
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    long long before = vec0_test_knn_abandoned;
+    assert(sqlite3_prepare_v2(db, "select rowid from v where a match ? and k = 2", -1, &stmt, NULL) == SQLITE_OK);
+    for(int j = 0; j < 256; j++) {
+      vector[j] = 1;
+    }
+    sqlite3_bind_blob(stmt, 1, vector, sizeof(vector), SQLITE_STATIC);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    assert(sqlite3_column_int64(stmt, 0) == 1);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    assert(sqlite3_column_int64(stmt, 0) == 2);
+    assert(sqlite3_step(stmt) == SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    assert(vec0_test_knn_abandoned > before);
+
+    sqlite3_close(db);
+    printf("✅ %s\n", metrics[m]);
+  }
+}
+
 int main() {
   printf("Starting unit tests...\n");
   test_vec0_parse_partition_key_definition();
+  test_bitmap();
+  test_knn_early_abandon();
 }